@@ -0,0 +1,140 @@
+/**
+ * crypto.h
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) sbcred contributors, October 2026.
+ */
+
+#ifndef __crypto_H
+#define __crypto_H
+
+#include "MULTOS.h"
+
+#define SHA1_BYTES 20
+#define SHA256_BYTES 32
+#define SHA256_BLOCK_BYTES 64
+
+#define AES_BLOCK_BYTES 16
+#define AES_KEY_BYTES 16
+
+#define RANDOM_BYTES 8
+
+/**
+ * Compute the secure hash of a message (see PRIM_SECURE_HASH).
+ *
+ * @param hashBytes size of the digest (SHA1_BYTES, SHA256_BYTES, ...).
+ * @param digest location where the digest will be written.
+ * @param message location of the message to be hashed.
+ * @param length in bytes of the message.
+ */
+#define SHA_hash(hashBytes, digest, message, length) \
+do { \
+  __push((unsigned int)(length)); \
+  __push((unsigned int)(hashBytes)); \
+  __push((void*)(digest)); \
+  __push((void*)(message)); \
+  __code(PRIM, PRIM_SECURE_HASH); \
+} while (0)
+
+/**
+ * Continue a secure hash computation (see PRIM_SECURE_HASH_IV).
+ *
+ * The returned message remainder is stored in remainderLength and
+ * remainder, which therefore have to be lvalues.
+ *
+ * @param hashBytes size of the digest (SHA1_BYTES, SHA256_BYTES, ...).
+ * @param digest location where the (final) digest will be written.
+ * @param message location of the next part of the message.
+ * @param length in bytes of the next part of the message.
+ * @param intermediate location of the intermediate hash value.
+ * @param counter location of the 4 byte count of bytes hashed so far.
+ * @param remainderLength number of bytes left over from the previous part.
+ * @param remainder location of the bytes left over from the previous part.
+ */
+#define SHA_hash_iv(hashBytes, digest, message, length, intermediate, counter, remainderLength, remainder) \
+do { \
+  __push((unsigned int)(length)); \
+  __push((unsigned int)(hashBytes)); \
+  __push((void*)(digest)); \
+  __push((void*)(message)); \
+  __push((void*)(intermediate)); \
+  __push((void*)(counter)); \
+  __push((unsigned int)(remainderLength)); \
+  __push((void*)(remainder)); \
+  __code(PRIM, PRIM_SECURE_HASH_IV); \
+  __code(STORE, &(remainder), 2); \
+  __code(STORE, &(remainderLength), 2); \
+} while (0)
+
+/**
+ * Encipher a block aligned message using AES in CBC mode (see
+ * PRIM_BLOCK_ENCIPHER).
+ *
+ * @param key location of the AES_KEY_BYTES key.
+ * @param iv location of the AES_BLOCK_BYTES initialisation vector.
+ * @param input location of the plaintext.
+ * @param length in bytes of the plaintext, a multiple of AES_BLOCK_BYTES.
+ * @param output location where the ciphertext will be written.
+ */
+#define AES_encipher(key, iv, input, length, output) \
+do { \
+  __push((unsigned char)(AES_BLOCK_BYTES)); \
+  __push((void*)(iv)); \
+  __push((unsigned int)(length)); \
+  __push((void*)(key)); \
+  __push((unsigned char)(AES_KEY_BYTES)); \
+  __push((void*)(output)); \
+  __push((void*)(input)); \
+  __code(PRIM, PRIM_BLOCK_ENCIPHER, BLOCK_CIPHER_ALGORITHM_AES, BLOCK_CIPHER_MODE_CBC); \
+} while (0)
+
+/**
+ * Decipher a block aligned message using AES in CBC mode (see
+ * PRIM_BLOCK_DECIPHER).
+ *
+ * @param key location of the AES_KEY_BYTES key.
+ * @param iv location of the AES_BLOCK_BYTES initialisation vector.
+ * @param input location of the ciphertext.
+ * @param length in bytes of the ciphertext, a multiple of AES_BLOCK_BYTES.
+ * @param output location where the plaintext will be written.
+ */
+#define AES_decipher(key, iv, input, length, output) \
+do { \
+  __push((unsigned char)(AES_BLOCK_BYTES)); \
+  __push((void*)(iv)); \
+  __push((unsigned int)(length)); \
+  __push((void*)(key)); \
+  __push((unsigned char)(AES_KEY_BYTES)); \
+  __push((void*)(output)); \
+  __push((void*)(input)); \
+  __code(PRIM, PRIM_BLOCK_DECIPHER, BLOCK_CIPHER_ALGORITHM_AES, BLOCK_CIPHER_MODE_CBC); \
+} while (0)
+
+/**
+ * Store RANDOM_BYTES random bytes (see PRIM_RANDOM_NUMBER).
+ *
+ * The primitive leaves the bytes on the stack, from where they are
+ * stored at a location fixed at compile time. The buffer therefore has
+ * to be the address of a session or static variable, not a pointer.
+ *
+ * @param buffer location where the random bytes will be written.
+ */
+#define RNG_bytes(buffer) \
+do { \
+  __code(PRIM, PRIM_RANDOM_NUMBER); \
+  __code(STORE, buffer, RANDOM_BYTES); \
+} while (0)
+
+#endif // __crypto_H
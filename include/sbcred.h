@@ -21,6 +21,91 @@
 #define __sbcred_H
 
 #include "ECC.h"
+#include "crypto.h"
+
+/*
+ * INStruction bytes
+ */
+#define INS_SBC_INITIALISE    0x01
+#define INS_SBC_PERSONALISE   0x02
+#define INS_SBC_GET_ATTRIBUTE 0x03
+#define INS_SBC_GET_KEY       0x04
+#define INS_SBC_COMPUTE_DH    0x05
+#define INS_SBC_PERSONALISE_DIGEST 0x06
+#define INS_SBC_ENVELOPE      0x07
+#define INS_SBC_COMPUTE_DH_BATCH 0x08
+#define INS_SBC_OPEN_SESSION  0x09
+
+/*
+ * Parameter bytes
+ */
+#define P1_DIGEST_FIRST 0x01
+#define P1_DIGEST_LAST  0x02
+
+#define P1_DH_POINTS    0x00
+#define P1_DH_SCALARS   0x01
+
+#define P1_SESSION_MAC     0x00
+#define P1_SESSION_ENCRYPT 0x01
+
+#define SBC_MAC_BYTES 8
+#define SBC_CHALLENGE_BYTES (2 * RANDOM_BYTES)
+
+/*
+ * Command fields, shared by the card and terminal codecs
+ */
+#define SBC_FIELD_BYTE        0x01 // value (1)
+#define SBC_FIELD_SCALAR      0x02 // length (2) | value (1 to ECC_KEY_BYTES)
+#define SBC_FIELD_POINT       0x03 // length (2) | 0x04 | x | y
+#define SBC_FIELD_BARE_SCALAR 0x04 // value (ECC_KEY_BYTES)
+#define SBC_FIELD_BARE_POINT  0x05 // 0x04 | x | y
+
+#define SBC_FIELDS_INITIALISE { SBC_FIELD_SCALAR, SBC_FIELD_SCALAR, \
+  SBC_FIELD_SCALAR, SBC_FIELD_SCALAR, SBC_FIELD_POINT }
+#define SBC_FIELDS_GET_ATTRIBUTE { SBC_FIELD_BYTE, SBC_FIELD_POINT }
+#define SBC_FIELDS_COMPUTE_DH { SBC_FIELD_SCALAR, SBC_FIELD_POINT }
+#define SBC_FIELDS_COMPUTE_DH_POINTS { SBC_FIELD_SCALAR } // followed by bare points
+#define SBC_FIELDS_COMPUTE_DH_SCALARS { SBC_FIELD_BARE_POINT } // followed by bare scalars
+#define SBC_FIELDS_PERSONALISE_DIGEST { SBC_FIELD_BYTE } // followed by a part
+#define SBC_FIELDS_OPEN_SESSION { SBC_FIELD_BARE_POINT }
+
+#define ATTRIBUTE_COUNT 4
+#define SBC_ATTRIBUTE_PENDING 0x80 // id flag of an attribute with a digest in progress
+
+#define SBC_CREDENTIAL_COUNT 4
+#define SBC_DOMAIN_COUNT 2 // shared by the credentials on the same curve
+
+#define SBC_LOG_SIZE 32
+#define SBC_LOG_PAGE 16
+#define SBC_LOG_HASH_BYTES 5
+
+#define SBC_PIN_BYTES 8
+#define SBC_PIN_TRIES 3
+
+/*
+ * Session RAM budgets in bytes, checked at build time: the total, the
+ * shared session state and the workspace of each instruction. On the
+ * card (2 byte int and pointer) these take, for the default curve:
+ *
+ *   SBC_session              130
+ *   initialise               123
+ *   SBC_attribute_workspace  232
+ *   SBC_dh_workspace          60
+ *   SBC_open_workspace        36
+ *   SBC_digest_workspace      36
+ */
+#define SBC_SESSION_BUDGET 400 // SBC_session and SBC_workspace
+#define SBC_STATE_BUDGET 160 // SBC_session
+#define SBC_PARAMS_BUDGET 128 // initialise
+#define SBC_ATTRIBUTE_BUDGET 240 // SBC_attribute_workspace
+#define SBC_DH_BUDGET 64 // SBC_dh_workspace
+#define SBC_OPEN_BUDGET 48 // SBC_open_workspace
+#define SBC_DIGEST_BUDGET 48 // SBC_digest_workspace
+
+typedef struct {
+  unsigned char *value;
+  unsigned int length;
+} SBC_value;
 
 typedef struct {
   unsigned char id;
@@ -29,14 +114,114 @@ typedef struct {
   ECC_point signature;
 } SBC_attribute;
 
+typedef struct {
+  unsigned char initialised;
+  unsigned char domain; // index of the shared domain parameters
+  ECC_key_pair keyPair;
+  SBC_attribute attribute[ATTRIBUTE_COUNT];
+} SBC_credential;
+
+typedef struct {
+  unsigned int counter;
+  unsigned char credential; // credential id, 1 to SBC_CREDENTIAL_COUNT
+  unsigned char id;
+  unsigned char nonce[SBC_LOG_HASH_BYTES];
+} SBC_log_entry;
+
+/*
+ * Session RAM state shared by the instructions, which is cleared on
+ * selection of the applet
+ */
+typedef struct {
+  unsigned char credentialIndex;
+  SBC_credential *credential;
+  ECC_domain_params *domain;
+  unsigned char digestId; // attribute being hashed, 0 if none
+  unsigned char digestCredential; // credential of the attribute being hashed
+  unsigned char digestIntermediate[SHA256_BYTES];
+  unsigned char digestCounter[4];
+  unsigned char open; // secure messaging session
+  unsigned char encrypt;
+  unsigned char key[SHA256_BYTES]; // encryption key | MAC key
+  unsigned char ssc[AES_BLOCK_BYTES];
+  unsigned char macState[AES_BLOCK_BYTES];
+  unsigned char macBlock[AES_BLOCK_BYTES];
+  unsigned char macFill;
+  unsigned char logLoaded;
+  unsigned int logHead; // index of the newest log entry
+  unsigned char pinVerified; // card PIN verified in this secure messaging session
+} SBC_session;
+
+/*
+ * Session RAM workspaces of the instructions, which overlay each other
+ */
+typedef struct {
+  ECC_domain_params blindParams; // domain parameters with the nonce as generator
+  ECC_key_pair blindPair;
+  SBC_log_entry logEntry;
+  unsigned char logHash[SHA1_BYTES];
+} SBC_attribute_workspace;
+
+typedef struct {
+  unsigned char x[ECC_KEY_BYTES];
+  ECC_point P;
+} SBC_dh_workspace;
+
+typedef struct {
+  unsigned char secret[ECC_KEY_BYTES + SBC_CHALLENGE_BYTES]; // shared secret | card challenge
+} SBC_open_workspace;
+
+typedef struct {
+  unsigned char digest[SHA256_BYTES];
+  unsigned int remainderLength;
+  unsigned char *remainder;
+} SBC_digest_workspace;
+
+typedef union {
+  ECC_domain_params params; // initialise
+  SBC_attribute_workspace attribute; // getAttribute
+  SBC_dh_workspace dh; // computeDH, computeDHBatch
+  SBC_open_workspace open; // openSession
+  SBC_digest_workspace digest; // personaliseDigest
+} SBC_workspace;
+
+unsigned int parseCommand(unsigned char *buffer, unsigned int length,
+    const unsigned char *fields, unsigned int count, SBC_value *values);
+
 void initialise(unsigned char *buffer);
 
 void personalise(unsigned char *buffer);
 
+void personaliseDigest(unsigned char *buffer);
+
 unsigned int getAttribute(unsigned char *buffer);
 
 unsigned int getKey(unsigned char *buffer);
 
 unsigned int computeDH(unsigned char *buffer);
 
+unsigned int computeDHBatch(unsigned char *buffer);
+
+unsigned int envelope(unsigned char *buffer);
+
+unsigned int openSession(unsigned char *buffer);
+
+void unwrapCommand(unsigned char *buffer);
+
+unsigned int wrapResponse(unsigned char *buffer, unsigned int length);
+
+void useCredential(unsigned char id);
+
+void selectCredential(void);
+
+unsigned int getCredentials(unsigned char *buffer);
+
+void verifyPin(unsigned char *buffer);
+
+void changePin(unsigned char *buffer);
+
+void logPresentation(unsigned char id, ECC_point *nonce);
+
+unsigned int getLog(unsigned char *buffer);
+
 #endif // __sbcred_H
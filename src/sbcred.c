@@ -26,15 +26,14 @@
 #include <ISO7816.h> // for APDU constants
 #include <multosarith.h> // for COPYN()
 #include <multosccr.h> // for ZFlag()
-#include <string.h> // for memset()
+#include <string.h> // for memcmp(), memmove(), memset()
 
 #include "APDU.h"
 #include "MULTOS.h"
+#include "crypto.h"
 #include "debug.h"
 #include "ECC.h"
 
-#define ATTRIBUTE_COUNT 4
-
 /********************************************************************/
 /* Public segment (APDU buffer) variable declaration                */
 /********************************************************************/
@@ -48,10 +47,20 @@ unsigned char APDU_buffer[255];
 /********************************************************************/
 #pragma melsession
 
-ECC_domain_params blindParams;
-ECC_key_pair blindPair;
-ECC_point P;
-ECC_point x;
+SBC_session session;
+
+// Scratch space of the current instruction only
+SBC_workspace workspace;
+
+// Fail the build when the session RAM, or any part of it, exceeds its budget
+typedef char SBC_session_budget[
+  (sizeof(SBC_session) + sizeof(SBC_workspace) <= SBC_SESSION_BUDGET) ? 1 : -1];
+typedef char SBC_state_budget[(sizeof(SBC_session) <= SBC_STATE_BUDGET) ? 1 : -1];
+typedef char SBC_params_budget[(sizeof(ECC_domain_params) <= SBC_PARAMS_BUDGET) ? 1 : -1];
+typedef char SBC_attribute_budget[(sizeof(SBC_attribute_workspace) <= SBC_ATTRIBUTE_BUDGET) ? 1 : -1];
+typedef char SBC_dh_budget[(sizeof(SBC_dh_workspace) <= SBC_DH_BUDGET) ? 1 : -1];
+typedef char SBC_open_budget[(sizeof(SBC_open_workspace) <= SBC_OPEN_BUDGET) ? 1 : -1];
+typedef char SBC_digest_budget[(sizeof(SBC_digest_workspace) <= SBC_DIGEST_BUDGET) ? 1 : -1];
 
 
 /********************************************************************/
@@ -59,10 +68,22 @@ ECC_point x;
 /********************************************************************/
 #pragma melstatic
 
-unsigned char initialised = 0x00;
-ECC_domain_params domainParams;
-ECC_key_pair keyPair;
-SBC_attribute attribute[ATTRIBUTE_COUNT];
+ECC_domain_params domainParams[SBC_DOMAIN_COUNT];
+SBC_credential credentials[SBC_CREDENTIAL_COUNT];
+SBC_log_entry presentationLog[SBC_LOG_SIZE];
+unsigned char cardPin[SBC_PIN_BYTES];
+unsigned char cardPinTries; // tries left, 0 until the PIN is set
+unsigned char cardPinSet;
+
+const unsigned char initialiseFields[] = SBC_FIELDS_INITIALISE;
+const unsigned char getAttributeFields[] = SBC_FIELDS_GET_ATTRIBUTE;
+const unsigned char computeDHFields[] = SBC_FIELDS_COMPUTE_DH;
+const unsigned char computeDHPointsFields[] = SBC_FIELDS_COMPUTE_DH_POINTS;
+const unsigned char computeDHScalarsFields[] = SBC_FIELDS_COMPUTE_DH_SCALARS;
+const unsigned char personaliseDigestFields[] = SBC_FIELDS_PERSONALISE_DIGEST;
+const unsigned char openSessionFields[] = SBC_FIELDS_OPEN_SESSION;
+const unsigned char pointFields[] = { SBC_FIELD_BARE_POINT };
+const unsigned char scalarFields[] = { SBC_FIELD_BARE_SCALAR };
 
 /********************************************************************/
 /* APDU handling                                                    */
@@ -71,215 +92,454 @@ SBC_attribute attribute[ATTRIBUTE_COUNT];
 void main(void) {
   unsigned int length = 0;
 
+  // Verify (and decipher) a command protected by secure messaging, which
+  // is required for every command once a session is open
+  if (APDU_wrapped) {
+    unwrapCommand(APDU_buffer);
+  } else if (session.open) {
+    debugWarning("Command not protected");
+    APDU_ReturnSW(SW_SECURITY_STATUS_NOT_SATISFIED);
+  }
+
+  // Act on the credential selected in this session (by default the first)
+  session.credential = &(credentials[session.credentialIndex]);
+  session.domain = &(domainParams[session.credential->domain]);
+
   switch (INS) {
-    case 0x02:
+    case INS_SBC_PERSONALISE:
       personalise(APDU_buffer);
-      APDU_Return();
+      break;
+
+    case INS_SBC_PERSONALISE_DIGEST:
+      personaliseDigest(APDU_buffer);
+      break;
 
-    case 0x03:
+    case INS_SBC_GET_ATTRIBUTE:
       length = getAttribute(APDU_buffer);
-      APDU_ReturnLa(length);
+      break;
 
-    case 0x01:
-      // Initialise the cards parameters and keys
+    case INS_SBC_INITIALISE:
+      // Initialise the cards parameters and keys, then fall through to
+      // return the freshly generated public key
       initialise(APDU_buffer);
 
-    case 0x04:
+    case INS_SBC_GET_KEY:
       // Return the cards public key
       length = getKey(APDU_buffer);
-      APDU_ReturnLa(length);
+      break;
 
-    case 0x05:
+    case INS_SBC_COMPUTE_DH:
       // Compute the Diffie-Hellman key agreement
       length = computeDH(APDU_buffer);
-      APDU_ReturnLa(length);
+      break;
+
+    case INS_SBC_COMPUTE_DH_BATCH:
+      // Compute several Diffie-Hellman key agreements
+      length = computeDHBatch(APDU_buffer);
+      break;
+
+    case INS_SBC_ENVELOPE:
+      // Execute a sequence of instructions
+      length = envelope(APDU_buffer);
+      break;
+
+    case INS_ADMIN_CREDENTIAL:
+      // Select the credential for this session
+      selectCredential();
+      break;
+
+    case INS_ADMIN_CREDENTIALS:
+      // Return the identifiers of the initialised credentials
+      length = getCredentials(APDU_buffer);
+      break;
+
+    case INS_ADMIN_LOG:
+      // Return a page of the presentation log
+      length = getLog(APDU_buffer);
+      break;
+
+    case INS_VERIFY:
+      // Verify the card PIN
+      verifyPin(APDU_buffer);
+      break;
+
+    case INS_CHANGE_REFERENCE_DATA:
+      // Set or change the card PIN
+      changePin(APDU_buffer);
+      break;
+
+    case INS_SBC_OPEN_SESSION:
+      // Derive the secure messaging session keys
+      length = openSession(APDU_buffer);
+      break;
 
     default:
       debugWarning("Unknown instruction");
       APDU_ReturnSW(ISO7816_SW_INS_NOT_SUPPORTED);
-    }
+  }
+
+  // Protect the response with secure messaging
+  if (APDU_wrapped) {
+    length = wrapResponse(APDU_buffer, length);
+  }
+
+  APDU_ReturnLa(length);
 }
 
 unsigned int getShort(unsigned char *buffer) {
   return (buffer[0] << 8) | buffer[1];
 }
 
+/**
+ * Check all fields of a command in a single pass and locate them in place
+ *
+ * For points the located value starts after the 0x04 encoding byte.
+ *
+ * @param buffer containing the command data
+ * @param length number of bytes of command data in the buffer
+ * @param fields the types (SBC_FIELD_*) of the fields of the command
+ * @param count number of fields of the command
+ * @param values in which the location and length of each field is stored
+ * @return number of bytes of command data taken by the fields
+ */
+unsigned int parseCommand(unsigned char *buffer, unsigned int length,
+    const unsigned char *fields, unsigned int count, SBC_value *values) {
+  unsigned int i, size, offset = 0;
+
+  for (i = 0; i < count; i++) {
+    switch (fields[i]) {
+      case SBC_FIELD_BYTE:
+        size = 1;
+        break;
+
+      case SBC_FIELD_BARE_SCALAR:
+        size = ECC_KEY_BYTES;
+        break;
+
+      case SBC_FIELD_BARE_POINT:
+        size = sizeof(ECC_point) + 1;
+        break;
+
+      default:
+        if (offset + 2 > length) {
+          debugError("Wrong length");
+          APDU_ReturnSW(SW_WRONG_LENGTH);
+        }
+        size = getShort(buffer + offset);
+        offset += 2;
+        if ((fields[i] == SBC_FIELD_POINT && size != sizeof(ECC_point) + 1) ||
+            (fields[i] == SBC_FIELD_SCALAR && (size == 0 || size > ECC_KEY_BYTES))) {
+          debugError("Wrong length");
+          APDU_ReturnSW(SW_WRONG_LENGTH);
+        }
+    }
+    if (offset + size > length) {
+      debugError("Wrong length");
+      APDU_ReturnSW(SW_WRONG_LENGTH);
+    }
+    if (fields[i] == SBC_FIELD_POINT || fields[i] == SBC_FIELD_BARE_POINT) {
+      if (buffer[offset] != 0x04) {
+        debugError("Unsupported point encoding");
+        APDU_ReturnSW(SW_WRONG_DATA);
+      }
+      offset++;
+      size--;
+    }
+
+    values[i].value = buffer + offset;
+    values[i].length = size;
+    offset += size;
+  }
+
+  return offset;
+}
+
 /**
  * Initialise the ECC domain parameters and generate a fresh key pair
  *
+ * Command data:  length (2) | p | length (2) | r | length (2) | a |
+ *                length (2) | b | length (2) | 0x04 | G.x | G.y
+ * Response data: see getKey()
+ *
+ * The domain parameters are stored in fields of ECC_KEY_BYTES, which the
+ * primitives read as a curve of that size: p has to be ECC_KEY_BYTES
+ * long and G has to be an uncompressed point of that size. r, a and b
+ * may be shorter, in which case they are padded with leading zeroes.
+ * Credentials initialised with the same domain parameters share a
+ * single copy of them.
+ *
  * @param buffer containing the domain parameters
  */
 void initialise(unsigned char *buffer) {
-  unsigned int length, offset = 0;
+  SBC_value values[sizeof(initialiseFields)];
+  unsigned int d;
 
-  if (initialised) {
+  if (session.credential->initialised) {
     debugWarning("Already initialised");
     APDU_ReturnSW(ISO7816_SW_COMMAND_NOT_ALLOWED_AGAIN);
   }
-
-  domainParams.format = 0x00; // format of domain params
-  domainParams.h = 0x01; // cofactor
-  domainParams.bytes = buffer[offset + 1];
-  debugInteger("bytes", domainParams.bytes);
-
-  // P
-  length = getShort(buffer + offset);
-  offset += 2;
-  if (length > ECC_KEY_BYTES) {
-    debugError("OVERFLOW");
+  parseCommand(buffer, Lc, initialiseFields, sizeof(initialiseFields), values);
+  if (values[0].length != ECC_KEY_BYTES) {
+    debugError("Wrong length of p");
     APDU_ReturnSW(SW_WRONG_LENGTH);
   }
-  memcpy(domainParams.p + ECC_KEY_BYTES - length, buffer + offset, length);
-  offset += length;
-  debugValue("Initialised P", domainParams.p, ECC_KEY_BYTES);
 
-  // R
-  length = getShort(buffer + offset);
-  offset += 2;
-  if (length > ECC_KEY_BYTES) {
-    debugError("OVERFLOW");
-    APDU_ReturnSW(SW_WRONG_LENGTH);
-  }
-  memcpy(domainParams.r + ECC_KEY_BYTES - length, buffer + offset, length);
-  offset += length;
-  debugValue("Initialised R", domainParams.r, ECC_KEY_BYTES);
+  // Gather the domain parameters in RAM, to look them up afterwards
+  memset(&(workspace.params), 0x00, sizeof(ECC_domain_params));
+  workspace.params.format = 0x00; // format of domain params
+  workspace.params.h = 0x01; // cofactor
+  workspace.params.bytes = ECC_KEY_BYTES;
+  debugInteger("bytes", workspace.params.bytes);
+  memcpy(workspace.params.p + ECC_KEY_BYTES - values[0].length, values[0].value, values[0].length);
+  debugValue("Initialised P", workspace.params.p, ECC_KEY_BYTES);
+  memcpy(workspace.params.r + ECC_KEY_BYTES - values[1].length, values[1].value, values[1].length);
+  debugValue("Initialised R", workspace.params.r, ECC_KEY_BYTES);
+  memcpy(workspace.params.a + ECC_KEY_BYTES - values[2].length, values[2].value, values[2].length);
+  debugValue("Initialised A", workspace.params.a, ECC_KEY_BYTES);
+  memcpy(workspace.params.b + ECC_KEY_BYTES - values[3].length, values[3].value, values[3].length);
+  debugValue("Initialised B", workspace.params.b, ECC_KEY_BYTES);
+  memcpy(&(workspace.params.G), values[4].value, sizeof(ECC_point));
+  debugValue("Initialised G.x", workspace.params.G.x, ECC_KEY_BYTES);
+  debugValue("Initialised G.y", workspace.params.G.y, ECC_KEY_BYTES);
 
-  // A
-  length = getShort(buffer + offset);
-  offset += 2;
-  if (length > ECC_KEY_BYTES) {
-    debugError("OVERFLOW");
-    APDU_ReturnSW(SW_WRONG_LENGTH);
+  // Share the domain parameters with credentials on the same curve
+  for (d = 0; d < SBC_DOMAIN_COUNT; d++) {
+    if (domainParams[d].bytes == 0x00 ||
+        memcmp(&(domainParams[d]), &(workspace.params), sizeof(ECC_domain_params)) == 0) {
+      break;
+    }
   }
-  memcpy(domainParams.a + ECC_KEY_BYTES - length, buffer + offset, length);
-  offset += length;
-  debugValue("Initialised A", domainParams.a, ECC_KEY_BYTES);
-
-  // B
-  length = getShort(buffer + offset);
-  offset += 2;
-  if (length > ECC_KEY_BYTES) {
-    debugError("OVERFLOW");
-    APDU_ReturnSW(SW_WRONG_LENGTH);
+  if (d >= SBC_DOMAIN_COUNT) {
+    debugError("No room for domain parameters");
+    APDU_ReturnSW(SW_NOT_ENOUGH_MEMORY);
   }
-  memcpy(domainParams.b + ECC_KEY_BYTES - length, buffer + offset, length);
-  offset += length;
-  debugValue("Initialised B", domainParams.b, ECC_KEY_BYTES);
-
-  // G
-  length = getShort(buffer + offset);
-  offset += 2;
-  if (buffer[offset++] != 0x04) {
-    debugError("Unsupported point encoding");
-    APDU_ReturnSW(SW_WRONG_DATA);
+  if (domainParams[d].bytes == 0x00) {
+    memcpy(&(domainParams[d]), &(workspace.params), sizeof(ECC_domain_params));
   }
-  memcpy(&(domainParams.G), buffer + offset, domainParams.bytes * 2);
-  offset += domainParams.bytes * 2;
-  debugValue("Initialised G.x", domainParams.G.x, ECC_KEY_BYTES);
-  debugValue("Initialised G.y", domainParams.G.y, ECC_KEY_BYTES);
+  debugInteger("domain", d);
+  session.credential->domain = d;
+  session.domain = &(domainParams[d]);
 
   // Generate keys
-  ECC_generate_keys(&domainParams, &keyPair);
-  debugValue("Initialised keyPair", &keyPair, sizeof(ECC_key_pair));
-  debugValue(" - private", keyPair.privateKey, ECC_KEY_BYTES);
-  debugValue(" - public.x", keyPair.publicKey.x, ECC_KEY_BYTES);
-  debugValue(" - public.y", keyPair.publicKey.y, ECC_KEY_BYTES);
+  ECC_generate_keys(session.domain, &(session.credential->keyPair));
+  debugValue("Initialised keyPair", &(session.credential->keyPair), sizeof(ECC_key_pair));
+  debugValue(" - private", session.credential->keyPair.privateKey, ECC_KEY_BYTES);
+  debugValue(" - public.x", session.credential->keyPair.publicKey.x, ECC_KEY_BYTES);
+  debugValue(" - public.y", session.credential->keyPair.publicKey.y, ECC_KEY_BYTES);
 
-  initialised = 1;
+  session.credential->initialised = 1;
 }
 
 /**
  * Personalise the card with a number of attributes
  *
+ * Command data:  count (2) | attribute * count
+ * Attribute:     id (1) | 0x04 | S.x | S.y | length (2) | value
+ *
+ * The id of an attribute (1 to ATTRIBUTE_COUNT) also determines the
+ * slot in which it is stored.
+ *
  * @param buffer containing the attributes to be stored on the card
  */
 void personalise(unsigned char *buffer) {
-  unsigned int i, index, count, offset = 0;
+  unsigned int i, index, count, length, offset = 0;
 
   // Get the number of attributes
-  count = (buffer[offset] << 8) | buffer[offset + 1];
+  count = getShort(buffer + offset);
   offset += 2;
   debugInteger("count", count);
 
-  // Process each attribute
+  // Check all attributes before storing any of them
   for (i = 0; i < count; i++) {
+    if (offset + 1 + 1 + sizeof(ECC_point) + 2 > Lc) {
+      debugError("Wrong length");
+      APDU_ReturnSW(SW_WRONG_LENGTH);
+    }
     index = buffer[offset] - 1;
-    debugInteger("index", index);
-    // Store the attribute ID
-    attribute[index].id = buffer[offset++];
-    debugInteger("ID", attribute[index].id);
-
-    // Store the attribute signature
-    if (buffer[offset++] != 0x04) {
+    if (index >= ATTRIBUTE_COUNT) {
+      debugError("Invalid attribute ID");
+      APDU_ReturnSW(SW_WRONG_DATA);
+    }
+    if (buffer[offset + 1] != 0x04) {
       debugError("Unsupported point encoding");
       APDU_ReturnSW(SW_WRONG_DATA);
     }
-    memcpy(&(attribute[index].signature), buffer + offset, sizeof(ECC_point));
+    offset += 1 + 1 + sizeof(ECC_point);
+    length = getShort(buffer + offset);
+    offset += 2;
+    if (length > sizeof(session.credential->attribute[index].value) || offset + length > Lc) {
+      debugError("Wrong length");
+      APDU_ReturnSW(SW_WRONG_LENGTH);
+    }
+    offset += length;
+  }
+  offset = 2;
+
+  // Process each attribute
+  for (i = 0; i < count; i++) {
+    index = buffer[offset++] - 1;
+    debugInteger("index", index);
+    // Invalidate the slot, so that an interrupted update is never used
+    session.credential->attribute[index].id = 0x00;
+
+    // Store the attribute signature (skipping the checked point encoding)
+    offset++;
+    memcpy(&(session.credential->attribute[index].signature), buffer + offset, sizeof(ECC_point));
     offset += sizeof(ECC_point);
-    debugValue("signature", &(attribute[index].signature), sizeof(ECC_point));
+    debugValue("signature", &(session.credential->attribute[index].signature), sizeof(ECC_point));
 
     // Store the attribute length
-    attribute[index].length = (buffer[offset] << 8) | buffer[offset + 1];
+    session.credential->attribute[index].length = getShort(buffer + offset);
     offset += 2;
-    debugInteger("length", attribute[index].length);
+    debugInteger("length", session.credential->attribute[index].length);
 
     // Store the attribute value
-    memcpy(attribute[index].value, buffer + offset, attribute[index].length);
-    offset += attribute[index].length;
-    debugValue("value", attribute[index].value, attribute[index].length);
+    memcpy(session.credential->attribute[index].value, buffer + offset, session.credential->attribute[index].length);
+    offset += session.credential->attribute[index].length;
+    debugValue("value", session.credential->attribute[index].value, session.credential->attribute[index].length);
+
+    // Store the attribute ID last to commit the update
+    session.credential->attribute[index].id = index + 1;
+    debugInteger("ID", session.credential->attribute[index].id);
+  }
+}
+
+/**
+ * Personalise the card with an attribute that is stored as its digest
+ *
+ * Command data:  id (1) | part of the value
+ *
+ * Long values are streamed in parts, the first and last of which are
+ * marked by P1_DIGEST_FIRST and P1_DIGEST_LAST, and only the SHA-256
+ * digest of the complete value is stored as attribute value. All parts
+ * but the last one have to be a multiple of SHA256_BLOCK_BYTES long.
+ * The attribute (and its signature over the digest) has to be
+ * personalised beforehand, with an empty value. All parts have to be
+ * sent to the same credential; selecting another one abandons the digest.
+ *
+ * Until the last part the attribute is marked as pending and cannot be
+ * presented. A digest that was abandoned, or torn by a reset, leaves the
+ * attribute pending; it is recovered by restarting the digest with
+ * P1_DIGEST_FIRST.
+ *
+ * @param buffer containing the next part of the attribute value
+ */
+void personaliseDigest(unsigned char *buffer) {
+  SBC_value value;
+  unsigned int index, length, offset;
+
+  offset = parseCommand(buffer, Lc, personaliseDigestFields, sizeof(personaliseDigestFields), &value);
+  length = Lc - offset;
+  index = value.value[0] - 1;
+  if (index >= ATTRIBUTE_COUNT) {
+    debugError("Invalid attribute ID");
+    APDU_ReturnSW(SW_WRONG_DATA);
+  }
+
+  if (P1 & P1_DIGEST_FIRST) {
+    if (session.credential->attribute[index].id != index + 1 &&
+        session.credential->attribute[index].id != ((index + 1) | SBC_ATTRIBUTE_PENDING)) {
+      APDU_ReturnSW(SW_RECORD_NOT_FOUND);
+    }
+
+    // Invalidate the slot until the digest is complete
+    session.credential->attribute[index].id = (index + 1) | SBC_ATTRIBUTE_PENDING;
+    memset(session.digestIntermediate, 0x00, SHA256_BYTES);
+    memset(session.digestCounter, 0x00, 4);
+    session.digestId = index + 1;
+    session.digestCredential = session.credentialIndex;
+  } else if (session.digestId != index + 1 || session.digestCredential != session.credentialIndex) {
+    debugError("No digest in progress");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+
+  if (!(P1 & P1_DIGEST_LAST) && length % SHA256_BLOCK_BYTES != 0) {
+    debugError("Part not block aligned");
+    APDU_ReturnSW(SW_WRONG_LENGTH);
+  }
+
+  // Hash the next part, the digest is kept in RAM until the last part;
+  // aligned parts leave no remainder, so it can point into the buffer
+  workspace.digest.remainderLength = 0;
+  workspace.digest.remainder = buffer + offset;
+  SHA_hash_iv(SHA256_BYTES, workspace.digest.digest, buffer + offset, length,
+    session.digestIntermediate, session.digestCounter, workspace.digest.remainderLength,
+    workspace.digest.remainder);
+  debugValue("intermediate", session.digestIntermediate, SHA256_BYTES);
+
+  if (P1 & P1_DIGEST_LAST) {
+    memcpy(session.credential->attribute[index].value, workspace.digest.digest, SHA256_BYTES);
+    session.credential->attribute[index].length = SHA256_BYTES;
+    debugValue("digest", session.credential->attribute[index].value, SHA256_BYTES);
+
+    // Store the attribute ID last to commit the update
+    session.credential->attribute[index].id = index + 1;
+    session.digestId = 0x00;
   }
 }
 
 /**
  * Generate an attribute prove and store it in the buffer
  *
+ * P1 holds the id of the credential to prove the attribute of, or 0x00
+ * for the credential selected in this session.
+ *
+ * Command data:  id (1) | length (2) | 0x04 | N.x | N.y
+ * Response data: length (2) | signed nonce |
+ *                length (2) | blinded key |
+ *                length (2) | blinded signature |
+ *                length (2) | attribute value
+ *
+ * The coordinates of the nonce N and the three blinded values are
+ * ECC_KEY_BYTES long each. For attributes personalised through
+ * personaliseDigest() the attribute value is the SHA256_BYTES digest.
+ *
  * @param buffer containing the attribute request, in which the attribute will be stored
  * @return number of bytes stored in the buffer
  */
 unsigned int getAttribute(unsigned char *buffer) {
-	unsigned int length = 0, index = 0, offset = 0;
+  SBC_value values[sizeof(getAttributeFields)];
+	unsigned int index = 0, offset = 0;
+  unsigned char id;
 
-  // Get the index, i.e. look-up the id, throw exception if not found
-  unsigned char id = buffer[offset++];
-  while (index < ATTRIBUTE_COUNT && attribute[index].id != id) {
-   	index++;
+  if (P1 != 0x00) {
+    useCredential(P1);
   }
-  if (index >= ATTRIBUTE_COUNT || attribute[index].id != id) {
-   	APDU_ReturnSW(SW_RECORD_NOT_FOUND);
+  if (!session.credential->initialised) {
+    debugWarning("Not initialised");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
   }
 
-  // Use the same domain parameters for the blinding
-  memcpy(&blindParams, &domainParams, sizeof(ECC_domain_params));
+  // Check the request, including the nonce, before touching any state
+  parseCommand(buffer, Lc, getAttributeFields, sizeof(getAttributeFields), values);
 
-  // Get the nonce send by the terminal
-  length = (buffer[offset] << 8) | buffer[offset + 1];
-	offset += 2;
-  if (buffer[offset++] != 0x04) {
-    debugError("Unsupported point encoding");
-    APDU_ReturnSW(SW_WRONG_DATA);
-  }
-  if (length != ECC_KEY_BYTES * 2 + 1) {
-    debugError("Wrong length");
-    APDU_ReturnSW(SW_WRONG_LENGTH);
+  // Get the index, which follows from the id, throw exception if not found
+  // (id 0 marks an attribute slot which has not been personalised)
+  id = values[0].value[0];
+  index = id - 1;
+  if (index >= ATTRIBUTE_COUNT || session.credential->attribute[index].id != id) {
+   	APDU_ReturnSW(SW_RECORD_NOT_FOUND);
   }
-  memcpy(&(blindParams.G), buffer + offset, blindParams.bytes * 2);
-  offset += blindParams.bytes * 2;
-  debugValue("N.x", blindParams.G.x, ECC_KEY_BYTES);
-  debugValue("N.y", blindParams.G.y, ECC_KEY_BYTES);
+
+  // Use the same domain parameters for the blinding, with the nonce as generator
+  memcpy(&(workspace.attribute.blindParams), session.domain, sizeof(ECC_domain_params));
+  memcpy(&(workspace.attribute.blindParams.G), values[1].value, sizeof(ECC_point));
+  debugValue("N.x", workspace.attribute.blindParams.G.x, ECC_KEY_BYTES);
+  debugValue("N.y", workspace.attribute.blindParams.G.y, ECC_KEY_BYTES);
 
 	offset = 0;
 
 	// Generate a blinding factor b, store it in blinder and blindKey
-  ECC_generate_keys(&blindParams, &blindPair);
-  debugValue("Generated blinding factor", &blindPair, sizeof(ECC_key_pair));
-  debugValue(" - private (blinding factor)", blindPair.privateKey, ECC_KEY_BYTES);
-  debugValue(" - public.x (blinded N)", blindPair.publicKey.x, ECC_KEY_BYTES);
-  debugValue(" - public.y (blinded N)", blindPair.publicKey.y, ECC_KEY_BYTES);
+  ECC_generate_keys(&(workspace.attribute.blindParams), &(workspace.attribute.blindPair));
+  debugValue("Generated blinding factor", &(workspace.attribute.blindPair), sizeof(ECC_key_pair));
+  debugValue(" - private (blinding factor)", workspace.attribute.blindPair.privateKey, ECC_KEY_BYTES);
+  debugValue(" - public.x (blinded N)", workspace.attribute.blindPair.publicKey.x, ECC_KEY_BYTES);
+  debugValue(" - public.y (blinded N)", workspace.attribute.blindPair.publicKey.y, ECC_KEY_BYTES);
 
 	// Sign the nonce using the private key
 	buffer[offset++] = ECC_KEY_BYTES >> 8;
 	buffer[offset++] = ECC_KEY_BYTES & 0xFF;
-	ECC_diffie_hellman(&domainParams, &(keyPair.privateKey), &(blindPair.publicKey), buffer + offset);
+	ECC_diffie_hellman(session.domain, &(session.credential->keyPair.privateKey), &(workspace.attribute.blindPair.publicKey), buffer + offset);
 	debugValue("Signed Nonce", buffer + offset, ECC_KEY_BYTES);
   offset += ECC_KEY_BYTES;
 
@@ -287,23 +547,25 @@ unsigned int getAttribute(unsigned char *buffer) {
   // Blind the public key using the blinding factor
 	buffer[offset++] = ECC_KEY_BYTES >> 8;
 	buffer[offset++] = ECC_KEY_BYTES & 0xFF;
-	ECC_diffie_hellman(&domainParams, &(blindPair.privateKey), &(keyPair.publicKey), buffer + offset);
+	ECC_diffie_hellman(session.domain, &(workspace.attribute.blindPair.privateKey), &(session.credential->keyPair.publicKey), buffer + offset);
 	debugValue("Blinded key", buffer + offset, ECC_KEY_BYTES);
   offset += ECC_KEY_BYTES;
 
   // Blind attribute signature, which is at attr_index + 2*lengthvalues.length + attribute_value.length
 	buffer[offset++] = ECC_KEY_BYTES >> 8;
 	buffer[offset++] = ECC_KEY_BYTES & 0xFF;
-	ECC_diffie_hellman(&domainParams, &(blindPair.privateKey), &(attribute[index].signature), buffer + offset);
+	ECC_diffie_hellman(session.domain, &(workspace.attribute.blindPair.privateKey), &(session.credential->attribute[index].signature), buffer + offset);
 	debugValue("Blinded signature", buffer + offset, ECC_KEY_BYTES);
   offset += ECC_KEY_BYTES;
 
   // Append attribute
-  buffer[offset++] = attribute[index].length >> 8;
-  buffer[offset++] = attribute[index].length & 0xFF;
-  memcpy(buffer + offset, attribute[index].value, attribute[index].length);
-  debugValue("attribute", buffer + offset, attribute[index].length);
-  offset += attribute[index].length;
+  buffer[offset++] = session.credential->attribute[index].length >> 8;
+  buffer[offset++] = session.credential->attribute[index].length & 0xFF;
+  memcpy(buffer + offset, session.credential->attribute[index].value, session.credential->attribute[index].length);
+  debugValue("attribute", buffer + offset, session.credential->attribute[index].length);
+  offset += session.credential->attribute[index].length;
+
+  logPresentation(id, &(workspace.attribute.blindParams.G));
 
   return offset;
 }
@@ -311,47 +573,747 @@ unsigned int getAttribute(unsigned char *buffer) {
 /**
  * Store the cards public key in the buffer
  *
+ * Response data: length (2) | 0x04 | K.x | K.y
+ *
  * @param buffer in which the key will be stored
  * @return number of bytes stored in the buffer
  */
 unsigned int getKey(unsigned char *buffer) {
   unsigned int length = sizeof(ECC_public_key) + 1, offset = 0;
 
+  if (!session.credential->initialised) {
+    debugWarning("Not initialised");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+
   // Length
   buffer[offset++] = length >> 8;
   buffer[offset++] = length & 0x00FF;
   buffer[offset++] = 0x04;
 
   // Value
-  memcpy(buffer + offset, &(keyPair.publicKey), sizeof(ECC_public_key));
+  memcpy(buffer + offset, &(session.credential->keyPair.publicKey), sizeof(ECC_public_key));
   offset += sizeof(ECC_public_key);
 
   return offset;
 }
 
+/**
+ * Compute a Diffie-Hellman key agreement for the given scalar and point
+ *
+ * Command data:  length (2) | x | length (2) | 0x04 | P.x | P.y
+ * Response data: x * P (ECC_KEY_BYTES * 2, zero padded)
+ *
+ * @param buffer containing the scalar and point, in which the result will be stored
+ * @return number of bytes stored in the buffer
+ */
 unsigned int computeDH(unsigned char *buffer) {
-  unsigned int length, offset = 0;
+  SBC_value values[sizeof(computeDHFields)];
+  unsigned char *scalar;
+  unsigned int offset;
 
-  length = getShort(buffer + offset);
-  offset += 2;
-  memcpy(&(x.x) + ECC_KEY_BYTES - length, buffer + offset, length);
-  offset += length;
-  length = getShort(buffer + offset);
-  offset += 2;
-  if (buffer[offset++] != 0x04) {
-    debugError("Unsupported point encoding");
-    APDU_ReturnSW(SW_WRONG_DATA);
+  if (!session.credential->initialised) {
+    debugWarning("Not initialised");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+  offset = parseCommand(buffer, Lc, computeDHFields, sizeof(computeDHFields), values);
+
+  // Use the scalar in place, unless it has to be padded
+  scalar = values[0].value;
+  if (values[0].length < ECC_KEY_BYTES) {
+    memset(workspace.dh.x, 0x00, ECC_KEY_BYTES);
+    memcpy(workspace.dh.x + ECC_KEY_BYTES - values[0].length, values[0].value, values[0].length);
+    scalar = workspace.dh.x;
+  }
+  debugValue("x", scalar, ECC_KEY_BYTES);
+  debugValue("P", values[1].value, sizeof(ECC_point));
+
+  // Compute the result behind the command data, then move it to the front
+  ECC_diffie_hellman(session.domain, scalar, values[1].value, buffer + offset);
+  memmove(buffer, buffer + offset, ECC_KEY_BYTES);
+  memset(buffer + ECC_KEY_BYTES, 0x00, ECC_KEY_BYTES);
+
+  return ECC_KEY_BYTES * 2;
+}
+
+/**
+ * Compute several Diffie-Hellman key agreements in a single command
+ *
+ * Command data (P1_DH_POINTS):  length (2) | x | point * n
+ * Command data (P1_DH_SCALARS): 0x04 | P.x | P.y | scalar * n
+ * Point:         0x04 | P.x | P.y
+ * Scalar:        x (ECC_KEY_BYTES)
+ * Response data: x * P (ECC_KEY_BYTES) * n
+ *
+ * The scalar and point are parsed once and every result is written over
+ * input that has already been consumed.
+ *
+ * @param buffer containing the scalars and points, in which the results will be stored
+ * @return number of bytes stored in the buffer
+ */
+unsigned int computeDHBatch(unsigned char *buffer) {
+  SBC_value value;
+  unsigned int count = 0, offset = 0;
+
+  if (!session.credential->initialised) {
+    debugWarning("Not initialised");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+
+  memset(workspace.dh.x, 0x00, ECC_KEY_BYTES);
+  if (P1 == P1_DH_POINTS) {
+    // One scalar against several points
+    offset = parseCommand(buffer, Lc, computeDHPointsFields, sizeof(computeDHPointsFields), &value);
+    memcpy(workspace.dh.x + ECC_KEY_BYTES - value.length, value.value, value.length);
+    debugValue("x", workspace.dh.x, ECC_KEY_BYTES);
+
+    while (offset < Lc) {
+      // The result may overwrite a short scalar and the point, use copies
+      offset += parseCommand(buffer + offset, Lc - offset, pointFields, sizeof(pointFields), &value);
+      memcpy(&(workspace.dh.P), value.value, sizeof(ECC_point));
+      debugValue("P", &(workspace.dh.P), sizeof(ECC_point));
+      ECC_diffie_hellman(session.domain, workspace.dh.x, &(workspace.dh.P), buffer + count * ECC_KEY_BYTES);
+      count++;
+    }
+  } else if (P1 == P1_DH_SCALARS) {
+    // Several scalars against one point
+    offset = parseCommand(buffer, Lc, computeDHScalarsFields, sizeof(computeDHScalarsFields), &value);
+    memcpy(&(workspace.dh.P), value.value, sizeof(ECC_point));
+    debugValue("P", &(workspace.dh.P), sizeof(ECC_point));
+
+    while (offset < Lc) {
+      // Each result ends before the scalar it is computed from
+      offset += parseCommand(buffer + offset, Lc - offset, scalarFields, sizeof(scalarFields), &value);
+      debugValue("x", value.value, ECC_KEY_BYTES);
+      ECC_diffie_hellman(session.domain, value.value, &(workspace.dh.P), buffer + count * ECC_KEY_BYTES);
+      count++;
+    }
+  } else {
+    APDU_ReturnSW(SW_WRONG_P1P2);
+  }
+
+  return count * ECC_KEY_BYTES;
+}
+
+/**
+ * Execute a sequence of instructions in a single command
+ *
+ * Command data:  command * n
+ * Command:       INS (1) | length (1) | data
+ * Response data: response * n
+ * Response:      length (2) | data
+ *
+ * P1 holds the id of the credential all commands act on, or 0x00 for
+ * the credential selected in this session.
+ *
+ * Only INS_SBC_GET_KEY, INS_SBC_GET_ATTRIBUTE and INS_SBC_COMPUTE_DH can
+ * be enveloped. The commands are moved to the end of the buffer and each
+ * response is built in front of the remaining commands, so the combined
+ * responses (and the secure messaging overhead, if any) have to fit in
+ * the buffer; the space of a getAttribute response follows from the
+ * length of the requested attribute.
+ *
+ * All commands and the space for their responses are checked before
+ * the first one is executed, so an envelope is either refused without
+ * side effects or executed completely. Responses therefore carry no
+ * status word of their own.
+ *
+ * @param buffer containing the commands, in which the responses will be stored
+ * @return number of bytes stored in the buffer
+ */
+unsigned int envelope(unsigned char *buffer) {
+  SBC_value attributeValues[sizeof(getAttributeFields)], dhValues[sizeof(computeDHFields)];
+  unsigned int index, length, start, command, size, limit, offset = 0;
+  unsigned char ins;
+
+  if (P1 != 0x00) {
+    useCredential(P1);
+  }
+  if (!session.credential->initialised) {
+    debugWarning("Not initialised");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+
+  // Move the commands to the end of the buffer
+  start = sizeof(APDU_buffer) - Lc;
+  memmove(buffer + start, buffer, Lc);
+
+  // Check every command and the space for its response
+  command = start;
+  while (command < sizeof(APDU_buffer)) {
+    if (command + 2 > sizeof(APDU_buffer)) {
+      debugError("Wrong length");
+      APDU_ReturnSW(SW_WRONG_LENGTH);
+    }
+    ins = buffer[command++];
+    length = buffer[command++];
+    debugInteger("INS", ins);
+    if (command + length > sizeof(APDU_buffer)) {
+      debugError("Wrong length");
+      APDU_ReturnSW(SW_WRONG_LENGTH);
+    }
+
+    // Determine the size of the response and the space needed to build it
+    switch (ins) {
+      case INS_SBC_GET_KEY:
+        size = 3 + sizeof(ECC_public_key);
+        limit = size;
+        break;
+
+      case INS_SBC_GET_ATTRIBUTE:
+        parseCommand(buffer + command, length, getAttributeFields, sizeof(getAttributeFields), attributeValues);
+        index = attributeValues[0].value[0] - 1;
+        if (index >= ATTRIBUTE_COUNT || session.credential->attribute[index].id != index + 1) {
+          APDU_ReturnSW(SW_RECORD_NOT_FOUND);
+        }
+        size = 3 * (2 + ECC_KEY_BYTES) + 2 + session.credential->attribute[index].length;
+        limit = size;
+        break;
+
+      case INS_SBC_COMPUTE_DH:
+        // The result is computed behind the command data
+        parseCommand(buffer + command, length, computeDHFields, sizeof(computeDHFields), dhValues);
+        size = ECC_KEY_BYTES * 2;
+        limit = length + ECC_KEY_BYTES;
+        break;
+
+      default:
+        debugWarning("Unsupported enveloped instruction");
+        APDU_ReturnSW(SW_INS_NOT_SUPPORTED);
+    }
+    if (limit < length) {
+      limit = length;
+    }
+    if (offset + 2 + limit > command) {
+      debugError("Response too long");
+      APDU_ReturnSW(SW_WRONG_LENGTH);
+    }
+    offset += 2 + size;
+    command += length;
+  }
+
+  // Reserve the space secure messaging adds to the response
+  if (APDU_wrapped) {
+    offset += SBC_MAC_BYTES;
+    if (session.encrypt) {
+      offset += AES_BLOCK_BYTES;
+    }
+  }
+  if (offset > sizeof(APDU_buffer)) {
+    debugError("Response too long");
+    APDU_ReturnSW(SW_WRONG_LENGTH);
+  }
+
+  // Execute each command in front of the remaining commands
+  offset = 0;
+  command = start;
+  while (command < sizeof(APDU_buffer)) {
+    ins = buffer[command++];
+    length = buffer[command++];
+    memmove(buffer + offset + 2, buffer + command, length);
+    command += length;
+    Lc = length;
+    switch (ins) {
+      case INS_SBC_GET_KEY:
+        length = getKey(buffer + offset + 2);
+        break;
+
+      case INS_SBC_GET_ATTRIBUTE:
+        length = getAttribute(buffer + offset + 2);
+        break;
+
+      case INS_SBC_COMPUTE_DH:
+        length = computeDH(buffer + offset + 2);
+        break;
+    }
+
+    // Frame the response
+    buffer[offset++] = length >> 8;
+    buffer[offset++] = length & 0xFF;
+    offset += length;
+  }
+
+  return offset;
+}
+
+/********************************************************************/
+/* Credential management                                            */
+/********************************************************************/
+
+/**
+ * Act on the given credential for the rest of the current command
+ *
+ * The credential is looked up by index, which takes the same time for
+ * every credential.
+ *
+ * @param id of the credential, 1 to SBC_CREDENTIAL_COUNT
+ */
+void useCredential(unsigned char id) {
+  if (id < 1 || id > SBC_CREDENTIAL_COUNT) {
+    APDU_ReturnSW(SW_REFERENCED_DATA_NOT_FOUND);
+  }
+
+  session.credential = &(credentials[id - 1]);
+  session.domain = &(domainParams[session.credential->domain]);
+}
+
+/**
+ * Select the credential on which subsequent commands in this session act
+ *
+ * P1 holds the credential id, 1 to SBC_CREDENTIAL_COUNT.
+ */
+void selectCredential(void) {
+  useCredential(P1);
+
+  session.credentialIndex = P1 - 1;
+
+  // Abandon a digest in progress, it belongs to the previous credential
+  session.digestId = 0x00;
+}
+
+/**
+ * Store the ids of the initialised credentials in the buffer
+ *
+ * Response data: id (1) * n
+ *
+ * @param buffer in which the ids will be stored
+ * @return number of bytes stored in the buffer
+ */
+unsigned int getCredentials(unsigned char *buffer) {
+  unsigned int i, offset = 0;
+
+  for (i = 0; i < SBC_CREDENTIAL_COUNT; i++) {
+    if (credentials[i].initialised) {
+      buffer[offset++] = i + 1;
+    }
   }
-  if (length != ECC_KEY_BYTES * 2 + 1) {
+
+  return offset;
+}
+
+/********************************************************************/
+/* Secure messaging                                                 */
+/********************************************************************/
+
+/**
+ * Open a secure messaging session based on a Diffie-Hellman key agreement
+ *
+ * Command data:  0x04 | E.x | E.y
+ * Response data: card challenge (SBC_CHALLENGE_BYTES)
+ *
+ * The terminal sends an ephemeral point E = e * G and computes the
+ * shared secret e * K from the public key K of the card. The card
+ * returns a fresh random challenge. The SHA-256 digest of the shared
+ * secret followed by the challenge yields the encryption key (first
+ * half) and the MAC key (second half) of the session, so a recorded
+ * session cannot be replayed to the card. With P1_SESSION_ENCRYPT the
+ * data of protected commands and responses is enciphered as well.
+ *
+ * Protected commands (CLA_SECURE_MESSAGING) and their responses then
+ * carry: data | MAC (SBC_MAC_BYTES)
+ *
+ * Once the session is open every command has to be protected, until the
+ * applet is selected again; a new session can only be opened after that,
+ * with a plain command. The SSC starts at zero and is incremented
+ * before each protected command and before each protected response. An
+ * instruction that fails returns its status word unprotected, without
+ * incrementing the SSC for a response, so the terminal continues from
+ * the SSC of the failed command. A command that fails verification
+ * (MAC, length or padding) closes the session and wipes its keys.
+ *
+ * @param buffer containing the ephemeral point of the terminal, in which the challenge will be stored
+ * @return number of bytes stored in the buffer
+ */
+unsigned int openSession(unsigned char *buffer) {
+  SBC_value value;
+
+  if (APDU_wrapped) {
+    debugWarning("Session already open");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+  if (!session.credential->initialised) {
+    debugWarning("Not initialised");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+  if (P1 != P1_SESSION_MAC && P1 != P1_SESSION_ENCRYPT) {
+    APDU_ReturnSW(SW_WRONG_P1P2);
+  }
+  if (parseCommand(buffer, Lc, openSessionFields, sizeof(openSessionFields), &value) != Lc) {
     debugError("Wrong length");
     APDU_ReturnSW(SW_WRONG_LENGTH);
   }
-  memcpy(&P, buffer + offset, ECC_KEY_BYTES * 2);
 
-  debugValue("x", &x, ECC_KEY_BYTES *2);
-  debugValue("P", &P, ECC_KEY_BYTES *2);
-  memset(buffer, 0x00, ECC_KEY_BYTES * 2);
-  ECC_diffie_hellman(&domainParams, &x, &P, buffer);
+  // Generate the challenge behind the shared secret
+  RNG_bytes(workspace.open.secret + ECC_KEY_BYTES);
+  RNG_bytes(workspace.open.secret + ECC_KEY_BYTES + RANDOM_BYTES);
+  debugValue("challenge", workspace.open.secret + ECC_KEY_BYTES, SBC_CHALLENGE_BYTES);
 
-  return ECC_KEY_BYTES * 2;
+  // Derive the session keys from the shared secret and the challenge,
+  // the shared secret is wiped after
+  ECC_diffie_hellman(session.domain, &(session.credential->keyPair.privateKey), value.value, workspace.open.secret);
+  SHA_hash(SHA256_BYTES, session.key, workspace.open.secret, sizeof(workspace.open.secret));
+  memset(workspace.open.secret, 0x00, ECC_KEY_BYTES);
+
+  memset(session.ssc, 0x00, AES_BLOCK_BYTES);
+  session.encrypt = (P1 == P1_SESSION_ENCRYPT);
+  session.pinVerified = 0;
+  session.open = 1;
+
+  memcpy(buffer, workspace.open.secret + ECC_KEY_BYTES, SBC_CHALLENGE_BYTES);
+
+  return SBC_CHALLENGE_BYTES;
+}
+
+/**
+ * Close the secure messaging session and wipe its keys
+ */
+void closeSession(void) {
+  session.open = 0;
+  session.pinVerified = 0;
+  session.encrypt = 0;
+  memset(session.key, 0x00, SHA256_BYTES);
+  memset(session.ssc, 0x00, AES_BLOCK_BYTES);
+}
+
+void incrementSSC(void) {
+  int i = AES_BLOCK_BYTES - 1;
+
+  while (i >= 0 && ++session.ssc[i] == 0x00) {
+    i--;
+  }
+}
+
+/**
+ * Compute the encryption IV for the current message, E(K_enc, SSC), in macBlock
+ */
+void computeIV(void) {
+  memset(session.macBlock, 0x00, AES_BLOCK_BYTES);
+  AES_encipher(session.key, session.macBlock, session.ssc, AES_BLOCK_BYTES, session.macBlock);
+}
+
+/**
+ * Start an AES CBC-MAC (ISO 9797-1 method 2 padding) chained on the SSC
+ */
+void macInit(void) {
+  memcpy(session.macState, session.ssc, AES_BLOCK_BYTES);
+  session.macFill = 0;
+}
+
+void macUpdate(unsigned char *data, unsigned int length) {
+  unsigned int n;
+
+  while (length > 0) {
+    n = AES_BLOCK_BYTES - session.macFill;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(session.macBlock + session.macFill, data, n);
+    session.macFill += n;
+    data += n;
+    length -= n;
+    if (session.macFill == AES_BLOCK_BYTES) {
+      AES_encipher(session.key + AES_KEY_BYTES, session.macState, session.macBlock, AES_BLOCK_BYTES, session.macState);
+      session.macFill = 0;
+    }
+  }
+}
+
+void macFinal(void) {
+  session.macBlock[session.macFill++] = 0x80;
+  memset(session.macBlock + session.macFill, 0x00, AES_BLOCK_BYTES - session.macFill);
+  AES_encipher(session.key + AES_KEY_BYTES, session.macState, session.macBlock, AES_BLOCK_BYTES, session.macState);
+}
+
+/**
+ * Verify the MAC of a protected command and decipher its data in place
+ *
+ * A command that fails verification closes the session.
+ *
+ * @param buffer containing the protected command data, Lc is updated
+ */
+void unwrapCommand(unsigned char *buffer) {
+  unsigned char header[4], diff = 0;
+  unsigned int i;
+
+  if (!session.open) {
+    debugWarning("No secure messaging session");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+  if (Lc < SBC_MAC_BYTES) {
+    debugError("Wrong length");
+    closeSession();
+    APDU_ReturnSW(SW_WRONG_LENGTH);
+  }
+  Lc -= SBC_MAC_BYTES;
+
+  // Verify the MAC over the header and the (enciphered) data
+  incrementSSC();
+  header[0] = CLA;
+  header[1] = INS;
+  header[2] = P1;
+  header[3] = P2;
+  macInit();
+  macUpdate(header, 4);
+  macUpdate(buffer, Lc);
+  macFinal();
+  for (i = 0; i < SBC_MAC_BYTES; i++) {
+    diff |= session.macState[i] ^ buffer[Lc + i];
+  }
+  if (diff != 0) {
+    debugError("Wrong MAC");
+    closeSession();
+    APDU_ReturnSW(SW_SECURITY_STATUS_NOT_SATISFIED);
+  }
+
+  if (session.encrypt && Lc > 0) {
+    if (Lc % AES_BLOCK_BYTES != 0) {
+      debugError("Wrong length");
+      closeSession();
+      APDU_ReturnSW(SW_WRONG_LENGTH);
+    }
+    computeIV();
+    AES_decipher(session.key, session.macBlock, buffer, Lc, buffer);
+
+    // Remove the padding
+    while (Lc > 0 && buffer[Lc - 1] == 0x00) {
+      Lc--;
+    }
+    if (Lc == 0 || buffer[--Lc] != 0x80) {
+      debugError("Wrong padding");
+      closeSession();
+      APDU_ReturnSW(SW_WRONG_DATA);
+    }
+  }
+}
+
+/**
+ * Encipher the response data in place and append its MAC
+ *
+ * @param buffer containing the response data
+ * @param length of the response data
+ * @return number of bytes of the protected response in the buffer
+ */
+unsigned int wrapResponse(unsigned char *buffer, unsigned int length) {
+  unsigned char sw[2];
+
+  // Check the size before the SSC is incremented for the response
+  if (length + SBC_MAC_BYTES > sizeof(APDU_buffer) || (session.encrypt &&
+      length + AES_BLOCK_BYTES + SBC_MAC_BYTES > sizeof(APDU_buffer))) {
+    debugError("Response too long");
+    APDU_ReturnSW(SW_WRONG_LENGTH);
+  }
+
+  incrementSSC();
+  if (session.encrypt && length > 0) {
+    buffer[length++] = 0x80;
+    while (length % AES_BLOCK_BYTES != 0) {
+      buffer[length++] = 0x00;
+    }
+    computeIV();
+    AES_encipher(session.key, session.macBlock, buffer, length, buffer);
+  }
+
+  // MAC the (enciphered) data and the status word
+  sw[0] = SW_NO_ERROR >> 8;
+  sw[1] = SW_NO_ERROR & 0xFF;
+  macInit();
+  macUpdate(buffer, length);
+  macUpdate(sw, 2);
+  macFinal();
+  memcpy(buffer + length, session.macState, SBC_MAC_BYTES);
+
+  return length + SBC_MAC_BYTES;
+}
+
+/********************************************************************/
+/* Card PIN                                                         */
+/********************************************************************/
+
+/**
+ * Check that a PIN command is protected by an enciphered session, so
+ * that the PIN never travels in the clear, and that it targets the card
+ * PIN
+ */
+void checkPinCommand(void) {
+  if (!APDU_wrapped || !session.encrypt) {
+    debugWarning("PIN requires an enciphered session");
+    APDU_ReturnSW(SW_SECURITY_STATUS_NOT_SATISFIED);
+  }
+  if (P2 != P2_CARD_PIN) {
+    APDU_ReturnSW(SW_WRONG_P1P2);
+  }
+  if (Lc != SBC_PIN_BYTES) {
+    debugError("Wrong length");
+    APDU_ReturnSW(SW_WRONG_LENGTH);
+  }
+}
+
+/**
+ * Verify the card PIN, which grants access to the presentation log for
+ * the rest of the secure messaging session
+ *
+ * Command data: PIN (SBC_PIN_BYTES)
+ *
+ * A try is used up before the PIN is compared, so tearing the card
+ * during verification does not give a free try. After SBC_PIN_TRIES
+ * wrong PINs in a row the PIN is blocked.
+ *
+ * @param buffer containing the PIN
+ */
+void verifyPin(unsigned char *buffer) {
+  unsigned char diff = 0;
+  unsigned int i;
+
+  checkPinCommand();
+  if (!cardPinSet) {
+    debugWarning("No PIN set");
+    APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+  }
+  if (cardPinTries == 0) {
+    debugWarning("PIN blocked");
+    APDU_ReturnSW(SW_FILE_INVALID);
+  }
+
+  cardPinTries--;
+  for (i = 0; i < SBC_PIN_BYTES; i++) {
+    diff |= cardPin[i] ^ buffer[i];
+  }
+  if (diff != 0) {
+    debugWarning("Wrong PIN");
+    APDU_ReturnSW(SW_COUNTER_PROVIDED_BY_X(0) | cardPinTries);
+  }
+
+  cardPinTries = SBC_PIN_TRIES;
+  session.pinVerified = 1;
+}
+
+/**
+ * Set or change the card PIN
+ *
+ * Command data: new PIN (SBC_PIN_BYTES)
+ *
+ * The first PIN can only be set before any credential is initialised,
+ * so that it is part of issuing the card. Changing it afterwards
+ * requires the current PIN to be verified in this session.
+ *
+ * @param buffer containing the new PIN
+ */
+void changePin(unsigned char *buffer) {
+  unsigned int i;
+
+  checkPinCommand();
+  if (cardPinSet) {
+    if (!session.pinVerified) {
+      APDU_ReturnSW(SW_SECURITY_STATUS_NOT_SATISFIED);
+    }
+  } else {
+    for (i = 0; i < SBC_CREDENTIAL_COUNT; i++) {
+      if (credentials[i].initialised) {
+        debugWarning("PIN has to be set before issuing");
+        APDU_ReturnSW(SW_CONDITIONS_NOT_SATISFIED);
+      }
+    }
+  }
+
+  memcpy(cardPin, buffer, SBC_PIN_BYTES);
+  cardPinTries = SBC_PIN_TRIES;
+  cardPinSet = 1;
+}
+
+/********************************************************************/
+/* Presentation log                                                 */
+/********************************************************************/
+
+/**
+ * Find the newest entry of the presentation log, once per session
+ *
+ * Entries are written round-robin with consecutive counters, so the
+ * newest entry is the one before the first break in the sequence. This
+ * avoids keeping (and constantly rewriting) a head index in EEPROM.
+ */
+void loadLog(void) {
+  unsigned int i;
+
+  if (session.logLoaded) {
+    return;
+  }
+
+  for (i = 1; i < SBC_LOG_SIZE; i++) {
+    if (presentationLog[i].counter != (unsigned int)(presentationLog[i - 1].counter + 1)) {
+      break;
+    }
+  }
+  session.logHead = i - 1;
+  session.logLoaded = 1;
+}
+
+/**
+ * Append a presentation of an attribute of the current credential to the log
+ *
+ * The entry is prepared in RAM and written with a single copy to the
+ * slot after the newest entry, which spreads the writes over the log.
+ *
+ * @param id of the presented attribute
+ * @param nonce sent by the terminal
+ */
+void logPresentation(unsigned char id, ECC_point *nonce) {
+  unsigned int next;
+
+  loadLog();
+  next = (session.logHead + 1) % SBC_LOG_SIZE;
+
+  workspace.attribute.logEntry.counter = presentationLog[session.logHead].counter + 1;
+  workspace.attribute.logEntry.credential = (session.credential - credentials) + 1;
+  workspace.attribute.logEntry.id = id;
+  SHA_hash(SHA1_BYTES, workspace.attribute.logHash, nonce, sizeof(ECC_point));
+  memcpy(workspace.attribute.logEntry.nonce, workspace.attribute.logHash, SBC_LOG_HASH_BYTES);
+  memcpy(&(presentationLog[next]), &(workspace.attribute.logEntry), sizeof(SBC_log_entry));
+  session.logHead = next;
+}
+
+/**
+ * Store a page of the presentation log in the buffer, newest first
+ *
+ * Response data: entry * n (at most SBC_LOG_PAGE)
+ * Entry:         counter (2) | credential id (1) | attribute id (1) |
+ *                nonce hash (SBC_LOG_HASH_BYTES)
+ *
+ * P1 selects the page, where page 0 holds the most recent presentations.
+ *
+ * The log links the presentations of the card: a verifier that reads it
+ * recognises its own earlier nonces, which undoes the unlinkability the
+ * blinding in getAttribute() provides. It is therefore only returned
+ * after the card PIN has been verified, which can only happen within an
+ * enciphered secure messaging session, so the log is never sent in the
+ * clear either.
+ *
+ * @param buffer in which the log entries will be stored
+ * @return number of bytes stored in the buffer
+ */
+unsigned int getLog(unsigned char *buffer) {
+  unsigned int i, index, offset = 0;
+
+  if (!session.pinVerified) {
+    debugWarning("PIN not verified");
+    APDU_ReturnSW(SW_SECURITY_STATUS_NOT_SATISFIED);
+  }
+  if (P1 >= SBC_LOG_SIZE / SBC_LOG_PAGE) {
+    APDU_ReturnSW(SW_WRONG_P1P2);
+  }
+
+  loadLog();
+  for (i = 0; i < SBC_LOG_PAGE; i++) {
+    index = (session.logHead + SBC_LOG_SIZE - P1 * SBC_LOG_PAGE - i) % SBC_LOG_SIZE;
+    if (presentationLog[index].id == 0x00) {
+      break;
+    }
+    buffer[offset++] = presentationLog[index].counter >> 8;
+    buffer[offset++] = presentationLog[index].counter & 0xFF;
+    buffer[offset++] = presentationLog[index].credential;
+    buffer[offset++] = presentationLog[index].id;
+    memcpy(buffer + offset, presentationLog[index].nonce, SBC_LOG_HASH_BYTES);
+    offset += SBC_LOG_HASH_BYTES;
+  }
+
+  return offset;
 }